@@ -0,0 +1,36 @@
+# - Find LZ4
+# Find the native LZ4 includes and library
+#
+#  LZ4_INCLUDE_DIRS - where to find lz4.h, etc.
+#  LZ4_LIBRARIES    - List of libraries when using LZ4.
+#  LZ4_FOUND        - True if LZ4 found.
+
+find_path(LZ4_INCLUDE_DIR
+  NAMES lz4.h
+  NO_DEFAULT_PATH
+  PATHS
+  /usr/local
+  /usr
+  PATH_SUFFIXES include
+  HINTS
+  ${LZ4_ROOT}
+  $ENV{LZ4_ROOT})
+
+find_library(LZ4_LIBRARY
+  NAMES lz4
+  NO_DEFAULT_PATH
+  PATHS
+  /usr/local
+  /usr
+  PATH_SUFFIXES lib
+  HINTS
+  ${LZ4_ROOT}
+  $ENV{LZ4_ROOT})
+
+include(FindPackageHandleStandardArgs)
+FIND_PACKAGE_HANDLE_STANDARD_ARGS(LZ4 DEFAULT_MSG LZ4_LIBRARY LZ4_INCLUDE_DIR)
+
+if(LZ4_FOUND)
+  set(LZ4_LIBRARIES ${LZ4_LIBRARY})
+  set(LZ4_INCLUDE_DIRS ${LZ4_INCLUDE_DIR})
+endif()
@@ -0,0 +1,36 @@
+# - Find ZSTD
+# Find the native ZSTD includes and library
+#
+#  ZSTD_INCLUDE_DIRS - where to find zstd.h, etc.
+#  ZSTD_LIBRARIES    - List of libraries when using ZSTD.
+#  ZSTD_FOUND        - True if ZSTD found.
+
+find_path(ZSTD_INCLUDE_DIR
+  NAMES zstd.h
+  NO_DEFAULT_PATH
+  PATHS
+  /usr/local
+  /usr
+  PATH_SUFFIXES include
+  HINTS
+  ${ZSTD_ROOT}
+  $ENV{ZSTD_ROOT})
+
+find_library(ZSTD_LIBRARY
+  NAMES zstd
+  NO_DEFAULT_PATH
+  PATHS
+  /usr/local
+  /usr
+  PATH_SUFFIXES lib
+  HINTS
+  ${ZSTD_ROOT}
+  $ENV{ZSTD_ROOT})
+
+include(FindPackageHandleStandardArgs)
+FIND_PACKAGE_HANDLE_STANDARD_ARGS(ZSTD DEFAULT_MSG ZSTD_LIBRARY ZSTD_INCLUDE_DIR)
+
+if(ZSTD_FOUND)
+  set(ZSTD_LIBRARIES ${ZSTD_LIBRARY})
+  set(ZSTD_INCLUDE_DIRS ${ZSTD_INCLUDE_DIR})
+endif()
@@ -0,0 +1,124 @@
+#pragma once
+
+#include <cstdint>
+#include <map>
+#include <mutex>
+#include <string>
+#include <sys/types.h>
+#include <unordered_map>
+#include <vector>
+
+namespace FUSE {
+
+/*
+ * Content-addressed, deduplicating store for file data.
+ *
+ * Files are split into variable-size chunks using a gear rolling hash, so that
+ * chunk boundaries follow the content rather than the write offsets. Each
+ * chunk is identified by a 128-bit digest and kept once in a reference counted
+ * index shared by all the files of the store. A file is an extent list mapping
+ * its logical offsets onto chunks. Holes, left by growing truncates and writes
+ * past the end of a file, are extents without a chunk.
+ *
+ * All the methods are thread-safe and follow the FUSE convention of returning
+ * a negative errno on failure.
+ */
+
+class ChunkStore {
+ public:
+
+  struct Digest {
+    uint64_t hi;
+    uint64_t lo;
+
+    bool operator==(const Digest & o) const {
+      return hi == o.hi && lo == o.lo;
+    }
+  };
+
+  /*
+   * Holes have no chunk and read as zeroes.
+   */
+  struct Extent {
+    off_t offset;
+    size_t length;
+    bool hole;
+    Digest digest;
+  };
+
+  struct Stats {
+    size_t files;
+    size_t chunks;
+    size_t logicalBytes;
+    size_t storedBytes;
+  };
+
+  /*
+   * The average chunk size is rounded down to a power of two. The sizes must
+   * verify, and are asserted to: 0 < minSize <= avgSize <= maxSize.
+   */
+  ChunkStore(const size_t minSize = 2048, const size_t avgSize = 8192,
+             const size_t maxSize = 65536);
+
+  int create(const std::string & path);
+  int remove(const std::string & path);
+  int rename(const std::string & path, const std::string & newpath);
+  /*
+   * Copy-on-write copy: newpath shares the chunks of path, and later writes to
+   * either file do not affect the other.
+   */
+  int clone(const std::string & path, const std::string & newpath);
+  int truncate(const std::string & path, const off_t newsize);
+
+  int read(const std::string & path, char * const buf, const size_t size,
+           const off_t offset) const;
+  int write(const std::string & path, const char * const buf,
+            const size_t size, const off_t offset);
+
+  bool exists(const std::string & path) const;
+  off_t size(const std::string & path) const;
+  std::vector<Extent> extents(const std::string & path) const;
+  Stats stats() const;
+
+  static Digest digest(const char * const data, const size_t size);
+
+ private:
+
+  struct Chunk {
+    std::string data;
+    size_t refs;
+  };
+
+  struct DigestHash {
+    size_t operator()(const Digest & d) const {
+      return static_cast<size_t>(d.lo);
+    }
+  };
+
+  using Extents = std::vector<Extent>;
+  using Index = std::unordered_map<Digest, Chunk, DigestHash>;
+
+  static off_t end(const Extents & extents);
+
+  void chunk(const char * const data, const size_t size, const off_t offset,
+             Extents & result);
+  Digest acquire(const char * const data, const size_t size);
+  void release(const Extent & extent);
+  void assemble(const Extents & extents, char * const buf, const size_t size,
+                const off_t offset) const;
+  void resize(Extents & extents, const off_t newsize);
+  void extend(Extents & extents, const off_t newsize);
+  void splice(Extents & extents, const char * const buf, const size_t size,
+              const off_t offset);
+
+  const size_t m_minSize;
+  const size_t m_maxSize;
+  const uint64_t m_mask;
+
+  mutable std::mutex m_lock;
+  std::map<std::string, Extents> m_files;
+  Index m_index;
+  size_t m_storedBytes;
+};
+
+}
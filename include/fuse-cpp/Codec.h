@@ -0,0 +1,70 @@
+#pragma once
+
+#include <cstddef>
+
+namespace FUSE {
+
+/*
+ * Block compression codec. Implementations must be stateless, as blocks are
+ * encoded and decoded concurrently.
+ */
+
+class Codec {
+ public:
+
+  virtual ~Codec() { }
+
+  /*
+   * Worst-case size of the compressed form of size bytes.
+   */
+  virtual size_t bound(const size_t size) const = 0;
+
+  /*
+   * Return the compressed size, or a value <= 0 if the data does not fit in
+   * capacity bytes.
+   */
+  virtual int compress(const char * const src, const size_t size,
+                       char * const dst, const size_t capacity) const = 0;
+
+  /*
+   * Return the decompressed size, or a negative value on corrupted input.
+   */
+  virtual int decompress(const char * const src, const size_t size,
+                         char * const dst, const size_t capacity) const = 0;
+};
+
+#ifdef HAVE_LZ4
+
+class LZ4Codec : public Codec {
+ public:
+
+  size_t bound(const size_t size) const;
+  int compress(const char * const src, const size_t size,
+               char * const dst, const size_t capacity) const;
+  int decompress(const char * const src, const size_t size,
+                 char * const dst, const size_t capacity) const;
+};
+
+#endif
+
+#ifdef HAVE_ZSTD
+
+class ZstdCodec : public Codec {
+ public:
+
+  ZstdCodec(const int level = 1);
+
+  size_t bound(const size_t size) const;
+  int compress(const char * const src, const size_t size,
+               char * const dst, const size_t capacity) const;
+  int decompress(const char * const src, const size_t size,
+                 char * const dst, const size_t capacity) const;
+
+ private:
+
+  const int m_level;
+};
+
+#endif
+
+}
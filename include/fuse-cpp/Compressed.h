@@ -0,0 +1,537 @@
+#pragma once
+
+#include <fuse-cpp/Compressor.h>
+#include <fuse-cpp/Layer.h>
+#include <algorithm>
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <fcntl.h>
+
+namespace FUSE {
+
+/*
+ * Layer transparently compressing the data of regular files, see Compressor
+ * for the layout of the inner files.
+ *
+ * The state of open files is keyed by the inode number reported by the inner
+ * layer, which must be unique across regular files as with the use_ino
+ * option. The size of a file that is not open is read from its header
+ * through a temporary handle. Files that cannot be opened for reading report
+ * the size of the inner file.
+ *
+ * Recently used blocks are kept decompressed in an LRU cache. Written blocks
+ * stay in memory, and are compressed and written back with the header on
+ * flush, fsync and release, or once a file has more dirty blocks than the
+ * cache holds. A block is thus compressed once however small the writes are.
+ * The dirty blocks are encoded in parallel by a worker pool started in
+ * init(), after FUSE has daemonized.
+ *
+ * Operations on a file are serialized, operations on different files run
+ * concurrently.
+ *
+ * The codec and options come first in the constructor, the remaining
+ * arguments are forwarded to the inner layer.
+ */
+
+template<typename Inner>
+class Compressed : public Layer<Inner> {
+ public:
+
+  template<typename... Args>
+  explicit Compressed(const Codec & codec, const Compressor::Options & options,
+                      Args &&... args)
+    : Base(std::forward<Args>(args)...)
+    , m_compressor(codec, options)
+  { }
+
+  int getattr(const char * const path, struct stat * const statbuf) {
+    int r = Base::getattr(path, statbuf);
+    if (r < 0 || !S_ISREG(statbuf->st_mode)) {
+      return r;
+    }
+    FileRef f = m_compressor.find(statbuf->st_ino);
+    if (f) {
+      std::lock_guard<std::mutex> lock(f->lock);
+      if (f->sized) {
+        statbuf->st_size = f->size;
+        return 0;
+      }
+    }
+    return peek(path, statbuf);
+  }
+
+  /*
+   * Forget the inode of the last link removed, as its number may be reused.
+   */
+  int unlink(const char * const path) {
+    struct stat st;
+    bool last = Base::getattr(path, &st) == 0 && S_ISREG(st.st_mode) &&
+      st.st_nlink <= 1;
+    int r = Base::unlink(path);
+    if (r == 0 && last) {
+      m_compressor.forget(st.st_ino);
+    }
+    return r;
+  }
+
+  int rename(const char * const path, const char * const newpath) {
+    struct stat src, dst;
+    bool last = Base::getattr(newpath, &dst) == 0 &&
+      S_ISREG(dst.st_mode) && dst.st_nlink <= 1 &&
+      !(Base::getattr(path, &src) == 0 && src.st_ino == dst.st_ino);
+    int r = Base::rename(path, newpath);
+    if (r == 0 && last) {
+      m_compressor.forget(dst.st_ino);
+    }
+    return r;
+  }
+
+  int truncate(const char * const path, const off_t newsize) {
+    struct stat st;
+    int r = Base::getattr(path, &st);
+    if (r < 0) {
+      return r;
+    }
+    if (!S_ISREG(st.st_mode)) {
+      return Base::truncate(path, newsize);
+    }
+    struct fuse_file_info fi;
+    memset(&fi, 0, sizeof(fi));
+    fi.flags = O_RDWR;
+    r = Base::open(path, &fi);
+    if (r < 0) {
+      return r;
+    }
+    FileRef f = m_compressor.acquire(st.st_ino);
+    {
+      std::lock_guard<std::mutex> lock(f->lock);
+      r = load(path, &fi, *f);
+      if (r == 0) {
+        r = resize(path, &fi, *f, newsize, false);
+      }
+    }
+    m_compressor.release(f);
+    Base::release(path, &fi);
+    return r;
+  }
+
+  /*
+   * Writes read back the header and partial blocks, and place slots at fixed
+   * offsets: the inner file must be readable and not in append mode.
+   */
+  int open(const char * const path, struct fuse_file_info * const fi) {
+    if ((fi->flags & O_ACCMODE) == O_WRONLY) {
+      fi->flags = (fi->flags & ~O_ACCMODE) | O_RDWR;
+    }
+    fi->flags &= ~O_APPEND;
+    int r = Base::open(path, fi);
+    if (r < 0) {
+      return r;
+    }
+    struct stat st;
+    r = Base::fgetattr(path, &st, fi);
+    if (r < 0) {
+      r = Base::getattr(path, &st);
+    }
+    if (r < 0) {
+      Base::release(path, fi);
+      return r;
+    }
+    FileRef f = m_compressor.acquire(st.st_ino);
+    {
+      std::lock_guard<std::mutex> lock(f->lock);
+      if (fi->flags & O_TRUNC) {
+        f->sized = true;
+        f->resized = false;
+        f->size = 0;
+        m_compressor.drop(*f, 0);
+      } else {
+        r = load(path, fi, *f);
+      }
+    }
+    if (r < 0) {
+      m_compressor.release(f);
+      Base::release(path, fi);
+      return r;
+    }
+    bool writable = (fi->flags & O_ACCMODE) != O_RDONLY;
+    Handle * h = new Handle { fi->fh, writable, f };
+    fi->fh = reinterpret_cast<uintptr_t>(h);
+    return 0;
+  }
+
+  int read(const char * const path, char * const buf, const size_t size,
+           const off_t offset, struct fuse_file_info * const fi) {
+    struct fuse_file_info ifi = inner(fi);
+    File & f = *handle(fi).file;
+    std::lock_guard<std::mutex> lock(f.lock);
+    if (offset >= f.size) {
+      return 0;
+    }
+    size_t bs = m_compressor.blockSize();
+    size_t len = std::min(size, static_cast<size_t>(f.size - offset));
+    std::string data;
+    for (size_t done = 0; done < len; ) {
+      off_t pos = offset + static_cast<off_t>(done);
+      size_t skip = static_cast<size_t>(pos % bs);
+      size_t n = std::min(bs - skip, len - done);
+      int r = fetch(path, &ifi, f, static_cast<uint64_t>(pos / bs), data);
+      if (r < 0) {
+        return r;
+      }
+      memcpy(buf + done, data.data() + skip, n);
+      done += n;
+    }
+    return static_cast<int>(len);
+  }
+
+  int write(const char * const path, const char * const buf,
+            const size_t size, const off_t offset,
+            struct fuse_file_info * const fi) {
+    if (size == 0) {
+      return 0;
+    }
+    struct fuse_file_info ifi = inner(fi);
+    File & f = *handle(fi).file;
+    std::lock_guard<std::mutex> lock(f.lock);
+    off_t lsize = f.size;
+    off_t bs = static_cast<off_t>(m_compressor.blockSize());
+    off_t last = offset + static_cast<off_t>(size);
+    off_t newsize = std::max(lsize, last);
+    /*
+     * Merge the written data into the blocks it covers. Only partially
+     * covered blocks need their previous content.
+     */
+    std::string data;
+    for (off_t base = offset - offset % bs; base < last; base += bs) {
+      uint64_t index = static_cast<uint64_t>(base / bs);
+      off_t length = std::min(bs, newsize - base);
+      off_t lo = std::max(offset, base);
+      off_t hi = std::min(last, base + bs);
+      if ((lo != base || hi < base + length) && base < lsize) {
+        int r = fetch(path, &ifi, f, index, data);
+        if (r < 0) {
+          return r;
+        }
+      } else {
+        data.assign(static_cast<size_t>(bs), '\0');
+      }
+      memcpy(&data[lo - base], buf + (lo - offset), hi - lo);
+      m_compressor.modify(f, index, data);
+    }
+    if (newsize != lsize) {
+      f.size = newsize;
+      f.resized = true;
+    }
+    if (f.dirty.size() > m_compressor.cacheSize()) {
+      int r = writeback(path, &ifi, f);
+      if (r < 0) {
+        return r;
+      }
+    }
+    return static_cast<int>(size);
+  }
+
+  /*
+   * Ask for big writes, which libfuse 2 only sends when requested.
+   */
+  void * init(struct fuse_conn_info * const conn) {
+    void * r = Base::init(conn);
+#ifdef FUSE_CAP_BIG_WRITES
+    if (conn->capable & FUSE_CAP_BIG_WRITES) {
+      conn->want |= FUSE_CAP_BIG_WRITES;
+    }
+#endif
+    m_compressor.start();
+    return r;
+  }
+
+  void destroy(void * const userdata) {
+    m_compressor.stop();
+    Base::destroy(userdata);
+  }
+
+  int flush(const char * const path, struct fuse_file_info * const fi) {
+    struct fuse_file_info ifi = inner(fi);
+    int r = sync(path, &ifi, handle(fi));
+    int e = Base::flush(path, &ifi);
+    return r < 0 ? r : e;
+  }
+
+  int release(const char * const path, struct fuse_file_info * const fi) {
+    Handle * h = &handle(fi);
+    struct fuse_file_info ifi = inner(fi);
+    int r = sync(path, &ifi, *h);
+    int e = Base::release(path, &ifi);
+    m_compressor.release(h->file);
+    delete h;
+    return r < 0 ? r : e;
+  }
+
+  int fsync(const char * const path, const int datasync,
+            struct fuse_file_info * const fi) {
+    struct fuse_file_info ifi = inner(fi);
+    int r = sync(path, &ifi, handle(fi));
+    if (r < 0) {
+      return r;
+    }
+    return Base::fsync(path, datasync, &ifi);
+  }
+
+  int ftruncate(const char * const path, const off_t offset,
+                struct fuse_file_info * const fi) {
+    struct fuse_file_info ifi = inner(fi);
+    File & f = *handle(fi).file;
+    std::lock_guard<std::mutex> lock(f.lock);
+    return resize(path, &ifi, f, offset, true);
+  }
+
+  int fgetattr(const char * const path, struct stat * const statbuf,
+               struct fuse_file_info * const fi) {
+    struct fuse_file_info ifi = inner(fi);
+    int r = Base::fgetattr(path, statbuf, &ifi);
+    if (r < 0 || !S_ISREG(statbuf->st_mode)) {
+      return r;
+    }
+    File & f = *handle(fi).file;
+    std::lock_guard<std::mutex> lock(f.lock);
+    statbuf->st_size = f.size;
+    return 0;
+  }
+
+ private:
+
+  using Base = Layer<Inner>;
+  using Block = Compressor::Block;
+  using File = Compressor::File;
+  using FileRef = Compressor::FileRef;
+  using Handle = Compressor::Handle;
+
+  static Handle & handle(const struct fuse_file_info * const fi) {
+    return *reinterpret_cast<Handle *>(static_cast<uintptr_t>(fi->fh));
+  }
+
+  /*
+   * Copy of fi carrying the handle of the inner layer, for the calls to it.
+   */
+  static struct fuse_file_info inner(const struct fuse_file_info * const fi) {
+    struct fuse_file_info r = *fi;
+    r.fh = handle(fi).fh;
+    return r;
+  }
+
+  /*
+   * Report the logical size of a regular file that is not open.
+   */
+  int peek(const char * const path, struct stat * const statbuf) {
+    struct fuse_file_info fi;
+    memset(&fi, 0, sizeof(fi));
+    fi.flags = O_RDONLY;
+    int r = Base::open(path, &fi);
+    if (r == -EACCES || r == -EPERM) {
+      return 0;
+    }
+    if (r < 0) {
+      return r;
+    }
+    off_t size;
+    r = readHeader(path, &fi, size);
+    Base::release(path, &fi);
+    if (r < 0) {
+      return r;
+    }
+    statbuf->st_size = size;
+    return 0;
+  }
+
+  int readHeader(const char * const path, struct fuse_file_info * const fi,
+                 off_t & size) {
+    char header[Compressor::HEADER];
+    int r = Base::read(path, header, sizeof(header), 0, fi);
+    if (r < 0) {
+      return r;
+    }
+    return m_compressor.header(header, static_cast<size_t>(r), size);
+  }
+
+  /*
+   * The helpers below expect the lock of the file to be held, and fi to be
+   * a handle of the inner layer.
+   */
+  int load(const char * const path, struct fuse_file_info * const fi,
+           File & file) {
+    if (file.sized) {
+      return 0;
+    }
+    off_t size;
+    int r = readHeader(path, fi, size);
+    if (r < 0) {
+      return r;
+    }
+    file.sized = true;
+    file.size = size;
+    return 0;
+  }
+
+  /*
+   * Write back the file through a writable handle. Read-only handles leave
+   * it to the writable ones, which all write back on release.
+   */
+  int sync(const char * const path, struct fuse_file_info * const fi,
+           Handle & handle) {
+    if (!handle.writable) {
+      return 0;
+    }
+    std::lock_guard<std::mutex> lock(handle.file->lock);
+    return writeback(path, fi, *handle.file);
+  }
+
+  int writeback(const char * const path, struct fuse_file_info * const fi,
+                File & file) {
+    off_t bs = static_cast<off_t>(m_compressor.blockSize());
+    std::vector<Block> blocks(file.dirty.size());
+    size_t k = 0;
+    for (auto & d : file.dirty) {
+      Block & b = blocks[k++];
+      off_t base = static_cast<off_t>(d.first) * bs;
+      b.index = d.first;
+      b.length = static_cast<size_t>(std::min(bs, file.size - base));
+      b.data.swap(d.second);
+    }
+    file.dirty.clear();
+    m_compressor.parallel(blocks.size(), [this, &blocks](size_t i) {
+      m_compressor.encode(blocks[i]);
+    });
+    /*
+     * Keep the blocks that could not be written dirty.
+     */
+    for (k = 0; k < blocks.size(); k += 1) {
+      int r = store(path, fi, blocks[k]);
+      if (r < 0) {
+        for (; k < blocks.size(); k += 1) {
+          file.dirty[blocks[k].index].swap(blocks[k].data);
+        }
+        return r;
+      }
+      m_compressor.insert(file, blocks[k].index, blocks[k].data);
+    }
+    return file.resized ? storeSize(path, fi, file, file.size) : 0;
+  }
+
+  int storeSize(const char * const path, struct fuse_file_info * const fi,
+                File & file, const off_t size) {
+    char header[Compressor::HEADER];
+    m_compressor.header(header, size);
+    int r = Base::write(path, header, sizeof(header), 0, fi);
+    if (r < 0) {
+      return r;
+    }
+    if (static_cast<size_t>(r) != sizeof(header)) {
+      return -EIO;
+    }
+    file.sized = true;
+    file.resized = false;
+    file.size = size;
+    return 0;
+  }
+
+  /*
+   * Resizing writes back first, then updates the inner file directly.
+   * Growing only updates the header, as holes read as zeroes. Shrinking cuts
+   * the last block and drops the slots past it.
+   */
+  int resize(const char * const path, struct fuse_file_info * const fi,
+             File & file, const off_t newsize, const bool byHandle) {
+    int r = writeback(path, fi, file);
+    if (r < 0) {
+      return r;
+    }
+    off_t lsize = file.size;
+    if (newsize < lsize) {
+      off_t bs = static_cast<off_t>(m_compressor.blockSize());
+      uint64_t index = static_cast<uint64_t>(newsize / bs);
+      size_t tail = static_cast<size_t>(newsize % bs);
+      uint64_t kept = tail ? index + 1 : index;
+      if (tail) {
+        Block b;
+        b.index = index;
+        b.length = tail;
+        r = fetch(path, fi, file, index, b.data);
+        if (r < 0) {
+          return r;
+        }
+        memset(&b.data[tail], 0, static_cast<size_t>(bs) - tail);
+        m_compressor.encode(b);
+        r = store(path, fi, b);
+        if (r < 0) {
+          return r;
+        }
+        m_compressor.insert(file, index, b.data);
+      }
+      m_compressor.drop(file, kept);
+      off_t end = m_compressor.slotOffset(kept);
+      r = byHandle ? Base::ftruncate(path, end, fi)
+                   : Base::truncate(path, end);
+      if (r < 0) {
+        return r;
+      }
+    }
+    return newsize != lsize ? storeSize(path, fi, file, newsize) : 0;
+  }
+
+  int fetch(const char * const path, struct fuse_file_info * const fi,
+            const File & file, const uint64_t index, std::string & data) {
+    if (m_compressor.lookup(file, index, data)) {
+      return 0;
+    }
+    char len[Compressor::LENGTH];
+    off_t offset = m_compressor.slotOffset(index);
+    int r = Base::read(path, len, sizeof(len), offset, fi);
+    if (r < 0) {
+      return r;
+    }
+    /*
+     * A slot past the end of the inner file is a hole.
+     */
+    std::string payload;
+    if (static_cast<size_t>(r) == sizeof(len)) {
+      size_t size;
+      r = m_compressor.payload(len, size);
+      if (r < 0) {
+        return r;
+      }
+      payload.resize(size);
+    }
+    if (!payload.empty()) {
+      r = Base::read(path, &payload[0], payload.size(),
+                     offset + static_cast<off_t>(sizeof(len)), fi);
+      if (r < 0) {
+        return r;
+      }
+      if (static_cast<size_t>(r) != payload.size()) {
+        return -EIO;
+      }
+    }
+    r = m_compressor.decode(len, payload, data);
+    if (r < 0) {
+      return r;
+    }
+    m_compressor.insert(file, index, data);
+    return 0;
+  }
+
+  int store(const char * const path, struct fuse_file_info * const fi,
+            const Block & block) {
+    int r = Base::write(path, block.slot.data(), block.slot.size(),
+                        m_compressor.slotOffset(block.index), fi);
+    if (r < 0) {
+      return r;
+    }
+    return static_cast<size_t>(r) == block.slot.size() ? 0 : -EIO;
+  }
+
+  Compressor m_compressor;
+};
+
+}
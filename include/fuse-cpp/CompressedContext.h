@@ -0,0 +1,22 @@
+#pragma once
+
+#include <fuse-cpp/Compressed.h>
+#include <fuse-cpp/Layer.h>
+
+namespace FUSE {
+
+/*
+ * Context transparently compressing the data of an existing Context, see
+ * Compressed. Stacks built with Chain can use the Compressed layer directly.
+ */
+
+class CompressedContext : public Stack<Compressed<Adapter>> {
+ public:
+
+  CompressedContext(Context & inner, const Codec & codec,
+                    const size_t blockSize = 65536,
+                    const size_t cacheSize = 64,
+                    const size_t threads = std::thread::hardware_concurrency());
+};
+
+}
@@ -0,0 +1,180 @@
+#pragma once
+
+#include <fuse-cpp/Codec.h>
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <list>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <sys/types.h>
+#include <thread>
+#include <utility>
+#include <vector>
+
+namespace FUSE {
+
+/*
+ * State of the Compressed layer that does not depend on the inner layer:
+ * block format, per-file state, decompressed block cache and encoding pool.
+ *
+ * The logical content of a file is cut into fixed-size blocks, each
+ * compressed independently so that a read only decodes the blocks it touches.
+ * The inner file holds a header with the logical size, followed by one slot
+ * per block, large enough for the worst-case compressed block:
+ *
+ *   [magic:4][block size:4][logical size:8][len:4|data]...[len:4|data]
+ *
+ * The unused tail of a slot is never written, so backends supporting sparse
+ * files only allocate the compressed bytes. A zero length marks a hole, and
+ * the RAW bit of the length marks a block stored uncompressed. Integers are
+ * little-endian.
+ */
+
+class Compressor {
+ public:
+
+  struct Options {
+    Options(const size_t blockSize = 65536, const size_t cacheSize = 64,
+            const size_t threads = std::thread::hardware_concurrency());
+
+    size_t blockSize;
+    size_t cacheSize;
+    size_t threads;
+  };
+
+  /*
+   * State of an open file, shared by its handles and hard links. The lock
+   * serializes the operations on the file and guards the size and the dirty
+   * blocks, which are not written back yet. Resized is set when the header
+   * is not written back either. The handle count is guarded by the lock of
+   * the compressor.
+   */
+  struct File {
+    std::mutex lock;
+    uint64_t id;
+    ino_t ino;
+    size_t handles;
+    bool sized;
+    bool resized;
+    off_t size;
+    std::map<uint64_t, std::string> dirty;
+  };
+
+  struct Block {
+    uint64_t index;
+    size_t length;
+    std::string data;
+    std::string slot;
+  };
+
+  using FileRef = std::shared_ptr<File>;
+
+  /*
+   * Open file handle. It takes the place of the handle of the inner layer in
+   * fi->fh.
+   */
+  struct Handle {
+    uint64_t fh;
+    bool writable;
+    FileRef file;
+  };
+
+  static const off_t HEADER = 16;
+  static const size_t LENGTH = 4;
+
+  Compressor(const Codec & codec, const Options & options);
+  ~Compressor();
+
+  size_t blockSize() const {
+    return m_blockSize;
+  }
+
+  size_t cacheSize() const {
+    return m_cacheSize;
+  }
+
+  off_t slotOffset(const uint64_t index) const;
+
+  void header(char * const buf, const off_t size) const;
+  int header(const char * const buf, const size_t len, off_t & size) const;
+
+  int payload(const char * const len, size_t & size) const;
+  int decode(const char * const len, const std::string & payload,
+             std::string & data) const;
+  void encode(Block & block) const;
+
+  /*
+   * Inode to open file state mapping. The state is created by the first
+   * handle and dropped, with its cached blocks, with the last one. Forgetting
+   * an inode detaches its state, so that a reused inode number gets its own.
+   */
+  FileRef acquire(const ino_t ino);
+  FileRef find(const ino_t ino);
+  void release(const FileRef & file);
+  void forget(const ino_t ino);
+
+  /*
+   * Block cache. Lookups see the dirty blocks of the file first, modify()
+   * turns a block dirty, and drop() forgets the blocks from an index on. The
+   * lock of the file must be held.
+   */
+  bool lookup(const File & file, const uint64_t index, std::string & data);
+  void insert(const File & file, const uint64_t index,
+              const std::string & data);
+  void modify(File & file, const uint64_t index, std::string & data);
+  void drop(File & file, const uint64_t from);
+
+  /*
+   * The encoding pool must be started once FUSE has daemonized, as threads
+   * do not survive the fork of fuse_main().
+   */
+  void start();
+  void stop();
+  void parallel(const size_t count, const std::function<void(size_t)> & job);
+
+ private:
+
+  using Key = std::pair<uint64_t, uint64_t>;
+  using Lru = std::list<Key>;
+
+  struct Entry {
+    std::string data;
+    Lru::iterator lru;
+  };
+
+  static const uint32_t MAGIC = 0x315A4346; // "FCZ1"
+  static const uint32_t RAW = 0x80000000;
+
+  void evict(const uint64_t id, const uint64_t from);
+  void worker(uint64_t seen);
+
+  const Codec & m_codec;
+  const size_t m_blockSize;
+  const size_t m_slotSize;
+  const size_t m_cacheSize;
+  const size_t m_threads;
+
+  std::mutex m_lock;
+  std::map<ino_t, FileRef> m_files;
+  uint64_t m_nextId;
+  std::map<Key, Entry> m_cache;
+  Lru m_lru;
+
+  std::mutex m_jobLock;
+  std::mutex m_poolLock;
+  std::condition_variable m_poolCond;
+  std::condition_variable m_doneCond;
+  std::vector<std::thread> m_workers;
+  const std::function<void(size_t)> * m_job;
+  size_t m_jobCount;
+  std::atomic<size_t> m_jobNext;
+  size_t m_jobActive;
+  uint64_t m_generation;
+  bool m_stop;
+};
+
+}
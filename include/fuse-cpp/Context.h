@@ -72,6 +72,8 @@ class Context {
 
  private:
 
+  friend class Adapter;
+
   static int s_getattr(const char * const path, struct stat * const statbuf);
   static int s_readlink(const char * const path, char *link, const size_t size);
   static int s_mknod(const char * const path, const mode_t mode, const dev_t dev);
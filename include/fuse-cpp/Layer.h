@@ -0,0 +1,725 @@
+#pragma once
+
+#include <fuse-cpp/Context.h>
+#include <cerrno>
+#include <type_traits>
+#include <utility>
+
+namespace FUSE {
+
+/*
+ * Compile-time layer stack.
+ *
+ * A stack is built from a backend, implementing the file system, and layers,
+ * each wrapping an inner object and forwarding every operation to it. All
+ * the operations are non-virtual and resolved at compile time, so a stack of
+ * layers inlines into direct calls. Only the Stack at the top is a Context,
+ * and costs the one virtual dispatch every Context already has:
+ *
+ *   template<typename Inner>
+ *   class Tracing : public Layer<Inner> {
+ *    public:
+ *     using Layer<Inner>::Layer;
+ *     int read(...) { trace(); return Layer<Inner>::read(...); }
+ *   };
+ *
+ *   Stack<Chain<MyBackend, Tracing, Caching>> fs(backendArgs...);
+ *   fs.run(argc, argv);
+ *
+ * An Adapter backend forwards to an existing Context, so that layers can
+ * also wrap a file system only known at run time.
+ */
+
+/*
+ * Whether Args is a single object of type Self, or derived from it. Used to
+ * keep the forwarding constructors from shadowing the copy constructors.
+ */
+
+template<typename Self, typename... Args>
+struct IsCopy : std::false_type { };
+
+template<typename Self, typename Arg>
+struct IsCopy<Self, Arg>
+  : std::is_base_of<Self, typename std::decay<Arg>::type> { };
+
+/*
+ * Bottom of a stack. Unimplemented operations return -ENOSYS.
+ */
+
+class Backend {
+ public:
+
+  int getattr(const char * const path, struct stat * const statbuf) {
+    return -ENOSYS;
+  }
+
+  int readlink(const char * const path, char *link, const size_t size) {
+    return -ENOSYS;
+  }
+
+  int mknod(const char * const path, const mode_t mode, const dev_t dev) {
+    return -ENOSYS;
+  }
+
+  int mkdir(const char * const path, const mode_t mode) {
+    return -ENOSYS;
+  }
+
+  int unlink(const char * const path) {
+    return -ENOSYS;
+  }
+
+  int rmdir(const char * const path) {
+    return -ENOSYS;
+  }
+
+  int symlink(const char * const path, const char * const link) {
+    return -ENOSYS;
+  }
+
+  int rename(const char * const path, const char * const newpath) {
+    return -ENOSYS;
+  }
+
+  int link(const char * const path, const char * const newpath) {
+    return -ENOSYS;
+  }
+
+  int chmod(const char * const path, const mode_t mode) {
+    return -ENOSYS;
+  }
+
+  int chown(const char * const path, const uid_t uid, const gid_t gid) {
+    return -ENOSYS;
+  }
+
+  int truncate(const char * const path, const off_t newsize) {
+    return -ENOSYS;
+  }
+
+  int utime(const char * const path, struct utimbuf * const ubuf) {
+    return -ENOSYS;
+  }
+
+  int open(const char * const path, struct fuse_file_info * const fi) {
+    return -ENOSYS;
+  }
+
+  int read(const char * const path, char * const buf, const size_t size,
+           const off_t offset, struct fuse_file_info * const fi) {
+    return -ENOSYS;
+  }
+
+  int write(const char * const path, const char * const buf, const size_t size,
+            const off_t offset, struct fuse_file_info * const fi) {
+    return -ENOSYS;
+  }
+
+  int statfs(const char * const path, struct statvfs * const statv) {
+    return -ENOSYS;
+  }
+
+  int flush(const char * const path, struct fuse_file_info * const fi) {
+    return -ENOSYS;
+  }
+
+  int release(const char * const path, struct fuse_file_info * const fi) {
+    return -ENOSYS;
+  }
+
+  int fsync(const char * const path, const int datasync,
+            struct fuse_file_info * const fi) {
+    return -ENOSYS;
+  }
+
+#ifdef HAVE_SYXATTR_H
+  int setxattr(const char * const path, const char * const name,
+               const char * const value, const size_t size, const int flags) {
+    return -ENOSYS;
+  }
+
+  int getxattr(const char * const path, const char * const name,
+               char * const value, const size_t size) {
+    return -ENOSYS;
+  }
+
+  int listxattr(const char * const path, char * const list, const size_t size) {
+    return -ENOSYS;
+  }
+
+  int removexattr(const char * const path, const char * const name) {
+    return -ENOSYS;
+  }
+#endif
+
+  int opendir(const char * const path, struct fuse_file_info * const fi) {
+    return -ENOSYS;
+  }
+
+  int readdir(const char * const path, void * const buf,
+              const fuse_fill_dir_t filler, const off_t offset,
+              struct fuse_file_info * const fi) {
+    return -ENOSYS;
+  }
+
+  int releasedir(const char * const path, struct fuse_file_info * const fi) {
+    return -ENOSYS;
+  }
+
+  int fsyncdir(const char * const path, const int datasync,
+               struct fuse_file_info * const fi) {
+    return -ENOSYS;
+  }
+
+  void * init(struct fuse_conn_info * const conn) {
+    return nullptr;
+  }
+
+  void destroy(void * const userdata) {
+  }
+
+  int access(const char * const path, const int mask) {
+    return -ENOSYS;
+  }
+
+  int ftruncate(const char * const path, const off_t offset,
+                struct fuse_file_info * const fi) {
+    return -ENOSYS;
+  }
+
+  int fgetattr(const char * const path, struct stat * const statbuf,
+               struct fuse_file_info * const fi) {
+    return -ENOSYS;
+  }
+};
+
+/*
+ * Bottom of a stack forwarding to a Context, to layer on top of an existing
+ * file system. The operations of the context are dispatched virtually.
+ */
+
+class Adapter {
+ public:
+
+  explicit Adapter(Context & context)
+    : m_context(context)
+  { }
+
+  int getattr(const char * const path, struct stat * const statbuf) {
+    return m_context.getattr(path, statbuf);
+  }
+
+  int readlink(const char * const path, char *link, const size_t size) {
+    return m_context.readlink(path, link, size);
+  }
+
+  int mknod(const char * const path, const mode_t mode, const dev_t dev) {
+    return m_context.mknod(path, mode, dev);
+  }
+
+  int mkdir(const char * const path, const mode_t mode) {
+    return m_context.mkdir(path, mode);
+  }
+
+  int unlink(const char * const path) {
+    return m_context.unlink(path);
+  }
+
+  int rmdir(const char * const path) {
+    return m_context.rmdir(path);
+  }
+
+  int symlink(const char * const path, const char * const link) {
+    return m_context.symlink(path, link);
+  }
+
+  int rename(const char * const path, const char * const newpath) {
+    return m_context.rename(path, newpath);
+  }
+
+  int link(const char * const path, const char * const newpath) {
+    return m_context.link(path, newpath);
+  }
+
+  int chmod(const char * const path, const mode_t mode) {
+    return m_context.chmod(path, mode);
+  }
+
+  int chown(const char * const path, const uid_t uid, const gid_t gid) {
+    return m_context.chown(path, uid, gid);
+  }
+
+  int truncate(const char * const path, const off_t newsize) {
+    return m_context.truncate(path, newsize);
+  }
+
+  int utime(const char * const path, struct utimbuf * const ubuf) {
+    return m_context.utime(path, ubuf);
+  }
+
+  int open(const char * const path, struct fuse_file_info * const fi) {
+    return m_context.open(path, fi);
+  }
+
+  int read(const char * const path, char * const buf, const size_t size,
+           const off_t offset, struct fuse_file_info * const fi) {
+    return m_context.read(path, buf, size, offset, fi);
+  }
+
+  int write(const char * const path, const char * const buf, const size_t size,
+            const off_t offset, struct fuse_file_info * const fi) {
+    return m_context.write(path, buf, size, offset, fi);
+  }
+
+  int statfs(const char * const path, struct statvfs * const statv) {
+    return m_context.statfs(path, statv);
+  }
+
+  int flush(const char * const path, struct fuse_file_info * const fi) {
+    return m_context.flush(path, fi);
+  }
+
+  int release(const char * const path, struct fuse_file_info * const fi) {
+    return m_context.release(path, fi);
+  }
+
+  int fsync(const char * const path, const int datasync,
+            struct fuse_file_info * const fi) {
+    return m_context.fsync(path, datasync, fi);
+  }
+
+#ifdef HAVE_SYXATTR_H
+  int setxattr(const char * const path, const char * const name,
+               const char * const value, const size_t size, const int flags) {
+    return m_context.setxattr(path, name, value, size, flags);
+  }
+
+  int getxattr(const char * const path, const char * const name,
+               char * const value, const size_t size) {
+    return m_context.getxattr(path, name, value, size);
+  }
+
+  int listxattr(const char * const path, char * const list, const size_t size) {
+    return m_context.listxattr(path, list, size);
+  }
+
+  int removexattr(const char * const path, const char * const name) {
+    return m_context.removexattr(path, name);
+  }
+#endif
+
+  int opendir(const char * const path, struct fuse_file_info * const fi) {
+    return m_context.opendir(path, fi);
+  }
+
+  int readdir(const char * const path, void * const buf,
+              const fuse_fill_dir_t filler, const off_t offset,
+              struct fuse_file_info * const fi) {
+    return m_context.readdir(path, buf, filler, offset, fi);
+  }
+
+  int releasedir(const char * const path, struct fuse_file_info * const fi) {
+    return m_context.releasedir(path, fi);
+  }
+
+  int fsyncdir(const char * const path, const int datasync,
+               struct fuse_file_info * const fi) {
+    return m_context.fsyncdir(path, datasync, fi);
+  }
+
+  void * init(struct fuse_conn_info * const conn) {
+    return m_context.init(conn);
+  }
+
+  void destroy(void * const userdata) {
+    m_context.destroy(userdata);
+  }
+
+  int access(const char * const path, const int mask) {
+    return m_context.access(path, mask);
+  }
+
+  int ftruncate(const char * const path, const off_t offset,
+                struct fuse_file_info * const fi) {
+    return m_context.ftruncate(path, offset, fi);
+  }
+
+  int fgetattr(const char * const path, struct stat * const statbuf,
+               struct fuse_file_info * const fi) {
+    return m_context.fgetattr(path, statbuf, fi);
+  }
+
+ private:
+
+  Context & m_context;
+};
+
+/*
+ * Base class for layers. Constructor arguments are forwarded to the inner
+ * object, down to the backend.
+ */
+
+template<typename Inner>
+class Layer {
+ public:
+
+  template<typename... Args, typename = typename
+           std::enable_if<!IsCopy<Layer, Args...>::value>::type>
+  explicit Layer(Args &&... args)
+    : m_inner(std::forward<Args>(args)...)
+  { }
+
+  Inner & inner() {
+    return m_inner;
+  }
+
+  int getattr(const char * const path, struct stat * const statbuf) {
+    return m_inner.getattr(path, statbuf);
+  }
+
+  int readlink(const char * const path, char *link, const size_t size) {
+    return m_inner.readlink(path, link, size);
+  }
+
+  int mknod(const char * const path, const mode_t mode, const dev_t dev) {
+    return m_inner.mknod(path, mode, dev);
+  }
+
+  int mkdir(const char * const path, const mode_t mode) {
+    return m_inner.mkdir(path, mode);
+  }
+
+  int unlink(const char * const path) {
+    return m_inner.unlink(path);
+  }
+
+  int rmdir(const char * const path) {
+    return m_inner.rmdir(path);
+  }
+
+  int symlink(const char * const path, const char * const link) {
+    return m_inner.symlink(path, link);
+  }
+
+  int rename(const char * const path, const char * const newpath) {
+    return m_inner.rename(path, newpath);
+  }
+
+  int link(const char * const path, const char * const newpath) {
+    return m_inner.link(path, newpath);
+  }
+
+  int chmod(const char * const path, const mode_t mode) {
+    return m_inner.chmod(path, mode);
+  }
+
+  int chown(const char * const path, const uid_t uid, const gid_t gid) {
+    return m_inner.chown(path, uid, gid);
+  }
+
+  int truncate(const char * const path, const off_t newsize) {
+    return m_inner.truncate(path, newsize);
+  }
+
+  int utime(const char * const path, struct utimbuf * const ubuf) {
+    return m_inner.utime(path, ubuf);
+  }
+
+  int open(const char * const path, struct fuse_file_info * const fi) {
+    return m_inner.open(path, fi);
+  }
+
+  int read(const char * const path, char * const buf, const size_t size,
+           const off_t offset, struct fuse_file_info * const fi) {
+    return m_inner.read(path, buf, size, offset, fi);
+  }
+
+  int write(const char * const path, const char * const buf, const size_t size,
+            const off_t offset, struct fuse_file_info * const fi) {
+    return m_inner.write(path, buf, size, offset, fi);
+  }
+
+  int statfs(const char * const path, struct statvfs * const statv) {
+    return m_inner.statfs(path, statv);
+  }
+
+  int flush(const char * const path, struct fuse_file_info * const fi) {
+    return m_inner.flush(path, fi);
+  }
+
+  int release(const char * const path, struct fuse_file_info * const fi) {
+    return m_inner.release(path, fi);
+  }
+
+  int fsync(const char * const path, const int datasync,
+            struct fuse_file_info * const fi) {
+    return m_inner.fsync(path, datasync, fi);
+  }
+
+#ifdef HAVE_SYXATTR_H
+  int setxattr(const char * const path, const char * const name,
+               const char * const value, const size_t size, const int flags) {
+    return m_inner.setxattr(path, name, value, size, flags);
+  }
+
+  int getxattr(const char * const path, const char * const name,
+               char * const value, const size_t size) {
+    return m_inner.getxattr(path, name, value, size);
+  }
+
+  int listxattr(const char * const path, char * const list, const size_t size) {
+    return m_inner.listxattr(path, list, size);
+  }
+
+  int removexattr(const char * const path, const char * const name) {
+    return m_inner.removexattr(path, name);
+  }
+#endif
+
+  int opendir(const char * const path, struct fuse_file_info * const fi) {
+    return m_inner.opendir(path, fi);
+  }
+
+  int readdir(const char * const path, void * const buf,
+              const fuse_fill_dir_t filler, const off_t offset,
+              struct fuse_file_info * const fi) {
+    return m_inner.readdir(path, buf, filler, offset, fi);
+  }
+
+  int releasedir(const char * const path, struct fuse_file_info * const fi) {
+    return m_inner.releasedir(path, fi);
+  }
+
+  int fsyncdir(const char * const path, const int datasync,
+               struct fuse_file_info * const fi) {
+    return m_inner.fsyncdir(path, datasync, fi);
+  }
+
+  void * init(struct fuse_conn_info * const conn) {
+    return m_inner.init(conn);
+  }
+
+  void destroy(void * const userdata) {
+    m_inner.destroy(userdata);
+  }
+
+  int access(const char * const path, const int mask) {
+    return m_inner.access(path, mask);
+  }
+
+  int ftruncate(const char * const path, const off_t offset,
+                struct fuse_file_info * const fi) {
+    return m_inner.ftruncate(path, offset, fi);
+  }
+
+  int fgetattr(const char * const path, struct stat * const statbuf,
+               struct fuse_file_info * const fi) {
+    return m_inner.fgetattr(path, statbuf, fi);
+  }
+
+ protected:
+
+  Inner m_inner;
+};
+
+/*
+ * Chain<B, L1, L2> is L1<L2<B>>: the first layer is the outermost.
+ */
+
+template<typename B, template<typename> class... Layers>
+struct Compose;
+
+template<typename B>
+struct Compose<B> {
+  using type = B;
+};
+
+template<typename B, template<typename> class L,
+         template<typename> class... Layers>
+struct Compose<B, L, Layers...> {
+  using type = L<typename Compose<B, Layers...>::type>;
+};
+
+template<typename B, template<typename> class... Layers>
+using Chain = typename Compose<B, Layers...>::type;
+
+/*
+ * Context running a stack. The stack, and not its backend, is the FUSE
+ * private data, hence init() returning this.
+ */
+
+template<typename Top>
+class Stack : public Context {
+ public:
+
+  template<typename... Args, typename = typename
+           std::enable_if<!IsCopy<Stack, Args...>::value>::type>
+  explicit Stack(Args &&... args)
+    : Context()
+    , m_top(std::forward<Args>(args)...)
+  { }
+
+  Top & top() {
+    return m_top;
+  }
+
+ protected:
+
+  virtual int getattr(const char * const path, struct stat * const statbuf) {
+    return m_top.getattr(path, statbuf);
+  }
+
+  virtual int readlink(const char * const path, char *link, const size_t size) {
+    return m_top.readlink(path, link, size);
+  }
+
+  virtual int mknod(const char * const path, const mode_t mode,
+                    const dev_t dev) {
+    return m_top.mknod(path, mode, dev);
+  }
+
+  virtual int mkdir(const char * const path, const mode_t mode) {
+    return m_top.mkdir(path, mode);
+  }
+
+  virtual int unlink(const char * const path) {
+    return m_top.unlink(path);
+  }
+
+  virtual int rmdir(const char * const path) {
+    return m_top.rmdir(path);
+  }
+
+  virtual int symlink(const char * const path, const char * const link) {
+    return m_top.symlink(path, link);
+  }
+
+  virtual int rename(const char * const path, const char * const newpath) {
+    return m_top.rename(path, newpath);
+  }
+
+  virtual int link(const char * const path, const char * const newpath) {
+    return m_top.link(path, newpath);
+  }
+
+  virtual int chmod(const char * const path, const mode_t mode) {
+    return m_top.chmod(path, mode);
+  }
+
+  virtual int chown(const char * const path, const uid_t uid, const gid_t gid) {
+    return m_top.chown(path, uid, gid);
+  }
+
+  virtual int truncate(const char * const path, const off_t newsize) {
+    return m_top.truncate(path, newsize);
+  }
+
+  virtual int utime(const char * const path, struct utimbuf * const ubuf) {
+    return m_top.utime(path, ubuf);
+  }
+
+  virtual int open(const char * const path, struct fuse_file_info * const fi) {
+    return m_top.open(path, fi);
+  }
+
+  virtual int read(const char * const path, char * const buf, const size_t size,
+                   const off_t offset, struct fuse_file_info * const fi) {
+    return m_top.read(path, buf, size, offset, fi);
+  }
+
+  virtual int write(const char * const path, const char * const buf,
+                    const size_t size, const off_t offset,
+                    struct fuse_file_info * const fi) {
+    return m_top.write(path, buf, size, offset, fi);
+  }
+
+  virtual int statfs(const char * const path, struct statvfs * const statv) {
+    return m_top.statfs(path, statv);
+  }
+
+  virtual int flush(const char * const path, struct fuse_file_info * const fi) {
+    return m_top.flush(path, fi);
+  }
+
+  virtual int release(const char * const path,
+                      struct fuse_file_info * const fi) {
+    return m_top.release(path, fi);
+  }
+
+  virtual int fsync(const char * const path, const int datasync,
+                    struct fuse_file_info * const fi) {
+    return m_top.fsync(path, datasync, fi);
+  }
+
+#ifdef HAVE_SYXATTR_H
+  virtual int setxattr(const char * const path, const char * const name,
+                       const char * const value, const size_t size,
+                       const int flags) {
+    return m_top.setxattr(path, name, value, size, flags);
+  }
+
+  virtual int getxattr(const char * const path, const char * const name,
+                       char * const value, const size_t size) {
+    return m_top.getxattr(path, name, value, size);
+  }
+
+  virtual int listxattr(const char * const path, char * const list,
+                        const size_t size) {
+    return m_top.listxattr(path, list, size);
+  }
+
+  virtual int removexattr(const char * const path, const char * const name) {
+    return m_top.removexattr(path, name);
+  }
+#endif
+
+  virtual int opendir(const char * const path,
+                      struct fuse_file_info * const fi) {
+    return m_top.opendir(path, fi);
+  }
+
+  virtual int readdir(const char * const path, void * const buf,
+                      const fuse_fill_dir_t filler, const off_t offset,
+                      struct fuse_file_info * const fi) {
+    return m_top.readdir(path, buf, filler, offset, fi);
+  }
+
+  virtual int releasedir(const char * const path,
+                         struct fuse_file_info * const fi) {
+    return m_top.releasedir(path, fi);
+  }
+
+  virtual int fsyncdir(const char * const path, const int datasync,
+                       struct fuse_file_info * const fi) {
+    return m_top.fsyncdir(path, datasync, fi);
+  }
+
+  virtual void * init(struct fuse_conn_info * const conn) {
+    m_top.init(conn);
+    return this;
+  }
+
+  virtual void destroy(void * const userdata) {
+    m_top.destroy(userdata);
+  }
+
+  virtual int access(const char * const path, const int mask) {
+    return m_top.access(path, mask);
+  }
+
+  virtual int ftruncate(const char * const path, const off_t offset,
+                        struct fuse_file_info * const fi) {
+    return m_top.ftruncate(path, offset, fi);
+  }
+
+  virtual int fgetattr(const char * const path, struct stat * const statbuf,
+                       struct fuse_file_info * const fi) {
+    return m_top.fgetattr(path, statbuf, fi);
+  }
+
+ private:
+
+  Top m_top;
+};
+
+}
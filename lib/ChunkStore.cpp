@@ -0,0 +1,560 @@
+#include <fuse-cpp/ChunkStore.h>
+#include <algorithm>
+#include <cassert>
+#include <cerrno>
+#include <cstring>
+
+namespace FUSE {
+
+/*
+ * Gear table for the rolling hash, and hashing primitives.
+ */
+
+namespace {
+
+static const uint64_t P1 = 0x9E3779B185EBCA87ULL;
+static const uint64_t P2 = 0xC2B2AE3D27D4EB4FULL;
+static const uint64_t P3 = 0x165667B19E3779F9ULL;
+static const uint64_t P4 = 0x85EBCA77C2B2AE63ULL;
+
+static const size_t LANES = 8;
+static const size_t STRIPE = LANES * sizeof(uint64_t);
+
+static const uint64_t KEY[LANES] = {
+  0xE81F9B0CBF4E7AF7ULL, 0xA8D4293433E798A1ULL, 0x6EB58EEA34854703ULL,
+  0x8B4486C599CB381BULL, 0x20BC3FD70E87A553ULL, 0xF37FE7B9C6BD7881ULL,
+  0x7A2D4F33C3B072E1ULL, 0xBAEC80760AAF3A95ULL
+};
+
+/*
+ * SSE2 has no profitable form of the digest kernel, so on x86-64 an AVX2
+ * clone is also built and selected at load time.
+ */
+#if defined(__x86_64__) && defined(__ELF__) && \
+  (defined(__clang__) ? __clang_major__ >= 14 : defined(__GNUC__))
+#define CHUNK_KERNEL __attribute__((target_clones("avx2", "default")))
+#else
+#define CHUNK_KERNEL
+#endif
+
+struct Gear {
+  Gear() {
+    uint64_t x = 0;
+    for (size_t i = 0; i < 256; i += 1) {
+      uint64_t z = (x += P1);
+      z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+      z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+      table[i] = z ^ (z >> 31);
+    }
+  }
+
+  uint64_t table[256];
+};
+
+static const Gear s_gear;
+
+inline uint64_t
+rotl(const uint64_t v, const int r)
+{
+  return (v << r) | (v >> (64 - r));
+}
+
+inline uint64_t
+avalanche(uint64_t h)
+{
+  h ^= h >> 33;
+  h *= P2;
+  h ^= h >> 29;
+  h *= P3;
+  h ^= h >> 32;
+  return h;
+}
+
+inline uint64_t
+load(const char * const data)
+{
+  uint64_t v;
+  memcpy(&v, data, sizeof(v));
+  return v;
+}
+
+/*
+ * Digest kernel, returning the number of bytes consumed.
+ */
+CHUNK_KERNEL size_t
+accumulate(const char * const data, const size_t size, uint64_t * const acc)
+{
+  uint64_t lanes[LANES];
+  memcpy(lanes, acc, sizeof(lanes));
+  size_t i = 0;
+  for (; i + STRIPE <= size; i += STRIPE) {
+    for (size_t k = 0; k < LANES; k += 1) {
+      uint64_t d = load(data + i + k * sizeof(uint64_t));
+      uint64_t v = d ^ KEY[k];
+      lanes[k] += d + (v & 0xFFFFFFFFULL) * (v >> 32);
+    }
+  }
+  memcpy(acc, lanes, sizeof(lanes));
+  return i;
+}
+
+inline off_t
+stop(const ChunkStore::Extent & e)
+{
+  return e.offset + static_cast<off_t>(e.length);
+}
+
+}
+
+/*
+ * Constructor.
+ */
+
+ChunkStore::ChunkStore(const size_t minSize, const size_t avgSize,
+                       const size_t maxSize)
+  : m_minSize(minSize)
+  , m_maxSize(maxSize)
+  , m_mask([avgSize]() {
+    int bits = 0;
+    while ((size_t(2) << bits) <= avgSize) bits += 1;
+    return bits ? ~uint64_t(0) << (64 - bits) : uint64_t(0);
+  }())
+  , m_lock()
+  , m_files()
+  , m_index()
+  , m_storedBytes(0)
+{
+  assert(0 < minSize && minSize <= avgSize && avgSize <= maxSize);
+}
+
+/*
+ * File operations.
+ */
+
+int
+ChunkStore::create(const std::string & path)
+{
+  std::lock_guard<std::mutex> lock(m_lock);
+  if (m_files.count(path)) {
+    return -EEXIST;
+  }
+  m_files[path] = Extents();
+  return 0;
+}
+
+int
+ChunkStore::remove(const std::string & path)
+{
+  std::lock_guard<std::mutex> lock(m_lock);
+  auto it = m_files.find(path);
+  if (it == m_files.end()) {
+    return -ENOENT;
+  }
+  for (auto & e : it->second) {
+    release(e);
+  }
+  m_files.erase(it);
+  return 0;
+}
+
+int
+ChunkStore::rename(const std::string & path, const std::string & newpath)
+{
+  std::lock_guard<std::mutex> lock(m_lock);
+  auto it = m_files.find(path);
+  if (it == m_files.end()) {
+    return -ENOENT;
+  }
+  if (path == newpath) {
+    return 0;
+  }
+  Extents extents;
+  extents.swap(it->second);
+  m_files.erase(it);
+  /*
+   * Like rename(2), silently replace the destination.
+   */
+  auto dst = m_files.find(newpath);
+  if (dst != m_files.end()) {
+    for (auto & e : dst->second) {
+      release(e);
+    }
+    dst->second.swap(extents);
+  } else {
+    m_files[newpath].swap(extents);
+  }
+  return 0;
+}
+
+int
+ChunkStore::clone(const std::string & path, const std::string & newpath)
+{
+  std::lock_guard<std::mutex> lock(m_lock);
+  auto it = m_files.find(path);
+  if (it == m_files.end()) {
+    return -ENOENT;
+  }
+  if (m_files.count(newpath)) {
+    return -EEXIST;
+  }
+  for (auto & e : it->second) {
+    if (!e.hole) {
+      m_index.find(e.digest)->second.refs += 1;
+    }
+  }
+  m_files[newpath] = it->second;
+  return 0;
+}
+
+int
+ChunkStore::truncate(const std::string & path, const off_t newsize)
+{
+  std::lock_guard<std::mutex> lock(m_lock);
+  auto it = m_files.find(path);
+  if (it == m_files.end()) {
+    return -ENOENT;
+  }
+  if (newsize < 0) {
+    return -EINVAL;
+  }
+  resize(it->second, newsize);
+  return 0;
+}
+
+int
+ChunkStore::read(const std::string & path, char * const buf, const size_t size,
+                 const off_t offset) const
+{
+  std::lock_guard<std::mutex> lock(m_lock);
+  auto it = m_files.find(path);
+  if (it == m_files.end()) {
+    return -ENOENT;
+  }
+  if (offset < 0) {
+    return -EINVAL;
+  }
+  off_t fsize = end(it->second);
+  if (offset >= fsize) {
+    return 0;
+  }
+  size_t len = std::min(size, static_cast<size_t>(fsize - offset));
+  assemble(it->second, buf, len, offset);
+  return static_cast<int>(len);
+}
+
+int
+ChunkStore::write(const std::string & path, const char * const buf,
+                  const size_t size, const off_t offset)
+{
+  std::lock_guard<std::mutex> lock(m_lock);
+  auto it = m_files.find(path);
+  if (it == m_files.end()) {
+    return -ENOENT;
+  }
+  if (offset < 0) {
+    return -EINVAL;
+  }
+  splice(it->second, buf, size, offset);
+  return static_cast<int>(size);
+}
+
+/*
+ * Introspection.
+ */
+
+bool
+ChunkStore::exists(const std::string & path) const
+{
+  std::lock_guard<std::mutex> lock(m_lock);
+  return m_files.count(path) != 0;
+}
+
+off_t
+ChunkStore::size(const std::string & path) const
+{
+  std::lock_guard<std::mutex> lock(m_lock);
+  auto it = m_files.find(path);
+  if (it == m_files.end()) {
+    return -ENOENT;
+  }
+  return end(it->second);
+}
+
+std::vector<ChunkStore::Extent>
+ChunkStore::extents(const std::string & path) const
+{
+  std::lock_guard<std::mutex> lock(m_lock);
+  auto it = m_files.find(path);
+  return it == m_files.end() ? Extents() : it->second;
+}
+
+ChunkStore::Stats
+ChunkStore::stats() const
+{
+  std::lock_guard<std::mutex> lock(m_lock);
+  Stats s = { m_files.size(), m_index.size(), 0, m_storedBytes };
+  for (auto & f : m_files) {
+    s.logicalBytes += static_cast<size_t>(end(f.second));
+  }
+  return s;
+}
+
+/*
+ * Chunk digest. The bulk of the data is consumed in 64-byte stripes by eight
+ * independent lanes, each adding the 32x32->64 product of the halves of its
+ * keyed input. The AVX2 clone of the kernel runs the lanes as vpmuludq. The
+ * lanes are then folded twice with different seeds to produce 128 bits.
+ */
+
+ChunkStore::Digest
+ChunkStore::digest(const char * const data, const size_t size)
+{
+  uint64_t acc[LANES] = { P1, P2, P3, P4, KEY[0], KEY[1], KEY[2], KEY[3] };
+  size_t i = accumulate(data, size, acc);
+  uint64_t hi = size * P1;
+  uint64_t lo = size * P2 + P3;
+  for (size_t k = 0; k < LANES; k += 1) {
+    hi = rotl(hi ^ avalanche(acc[k]), 27) * P1 + P4;
+    lo = rotl(lo ^ avalanche(acc[LANES - 1 - k] + KEY[k]), 31) * P2 + P3;
+  }
+  for (; i + sizeof(uint64_t) <= size; i += sizeof(uint64_t)) {
+    uint64_t v = load(data + i);
+    hi = rotl(hi ^ (rotl(v * P2, 31) * P1), 27) * P1 + P4;
+    lo = rotl(lo ^ (rotl(v * P3, 29) * P2), 23) * P2 + P3;
+  }
+  for (; i < size; i += 1) {
+    uint64_t v = static_cast<uint8_t>(data[i]);
+    hi = rotl(hi ^ (v * P4), 11) * P1;
+    lo = rotl(lo ^ (v * P1), 13) * P3;
+  }
+  Digest d = { avalanche(hi), avalanche(lo ^ hi) };
+  return d;
+}
+
+/*
+ * Internal helpers. The lock must be held by the caller.
+ */
+
+off_t
+ChunkStore::end(const Extents & extents)
+{
+  return extents.empty() ? 0 : stop(extents.back());
+}
+
+void
+ChunkStore::chunk(const char * const data, const size_t size,
+                  const off_t offset, Extents & result)
+{
+  size_t pos = 0;
+  while (pos < size) {
+    size_t left = size - pos;
+    size_t limit = std::min(left, m_maxSize);
+    size_t len = limit;
+    if (left > m_minSize) {
+      uint64_t h = 0;
+      for (size_t i = m_minSize; i < limit; i += 1) {
+        h = (h << 1) + s_gear.table[static_cast<uint8_t>(data[pos + i])];
+        if (!(h & m_mask)) {
+          len = i + 1;
+          break;
+        }
+      }
+    }
+    Extent e = { offset + static_cast<off_t>(pos), len, false,
+      acquire(data + pos, len) };
+    result.push_back(e);
+    pos += len;
+  }
+}
+
+ChunkStore::Digest
+ChunkStore::acquire(const char * const data, const size_t size)
+{
+  Digest d = digest(data, size);
+  /*
+   * Probe linearly on the (unlikely) event of a digest collision. Released
+   * chunks leave no marker: a chunk probed past one that is released is no
+   * longer found, and its content is stored again under the freed digest. A
+   * collision thus only costs deduplication, never correctness.
+   */
+  for (;;) {
+    auto it = m_index.find(d);
+    if (it == m_index.end()) {
+      Chunk c = { std::string(data, size), 1 };
+      m_index.insert(std::make_pair(d, std::move(c)));
+      m_storedBytes += size;
+      return d;
+    }
+    if (it->second.data.size() == size &&
+        memcmp(it->second.data.data(), data, size) == 0) {
+      it->second.refs += 1;
+      return d;
+    }
+    d.lo += 1;
+  }
+}
+
+void
+ChunkStore::release(const Extent & extent)
+{
+  if (extent.hole) {
+    return;
+  }
+  auto it = m_index.find(extent.digest);
+  if (it == m_index.end()) {
+    return;
+  }
+  it->second.refs -= 1;
+  if (it->second.refs == 0) {
+    m_storedBytes -= it->second.data.size();
+    m_index.erase(it);
+  }
+}
+
+void
+ChunkStore::assemble(const Extents & extents, char * const buf,
+                     const size_t size, const off_t offset) const
+{
+  auto it = std::upper_bound(extents.begin(), extents.end(), offset,
+                             [](const off_t v, const Extent & e) {
+                               return v < stop(e);
+                             });
+  size_t done = 0;
+  for (; done < size && it != extents.end(); ++it) {
+    size_t skip = static_cast<size_t>(offset + done - it->offset);
+    size_t len = std::min(size - done, it->length - skip);
+    if (it->hole) {
+      memset(buf + done, 0, len);
+    } else {
+      const std::string & data = m_index.find(it->digest)->second.data;
+      memcpy(buf + done, data.data() + skip, len);
+    }
+    done += len;
+  }
+}
+
+void
+ChunkStore::resize(Extents & extents, const off_t newsize)
+{
+  if (newsize >= end(extents)) {
+    extend(extents, newsize);
+    return;
+  }
+  /*
+   * Shrink, keeping the head of the extent that spans the new end.
+   */
+  auto it = std::upper_bound(extents.begin(), extents.end(), newsize,
+                             [](const off_t v, const Extent & e) {
+                               return v < stop(e);
+                             });
+  size_t first = static_cast<size_t>(it - extents.begin());
+  Extents head;
+  if (it != extents.end() && it->offset < newsize) {
+    Extent e = *it;
+    e.length = static_cast<size_t>(newsize - it->offset);
+    if (!e.hole) {
+      std::string data(e.length, '\0');
+      assemble(extents, &data[0], data.size(), it->offset);
+      e.digest = acquire(data.data(), data.size());
+    }
+    head.push_back(e);
+  }
+  for (size_t i = first; i < extents.size(); i += 1) {
+    release(extents[i]);
+  }
+  extents.resize(first);
+  extents.insert(extents.end(), head.begin(), head.end());
+}
+
+/*
+ * Grow with a hole, merged with the tail extent if it is a hole already.
+ */
+
+void
+ChunkStore::extend(Extents & extents, const off_t newsize)
+{
+  off_t fsize = end(extents);
+  if (newsize <= fsize) {
+    return;
+  }
+  size_t len = static_cast<size_t>(newsize - fsize);
+  if (!extents.empty() && extents.back().hole) {
+    extents.back().length += len;
+    return;
+  }
+  Extent e = { fsize, len, true, Digest() };
+  extents.push_back(e);
+}
+
+void
+ChunkStore::splice(Extents & extents, const char * const buf,
+                   const size_t size, const off_t offset)
+{
+  if (size == 0) {
+    return;
+  }
+  extend(extents, offset);
+  off_t fsize = end(extents);
+  off_t last = offset + static_cast<off_t>(size);
+  /*
+   * Find the range of extents overlapped by the write. When appending, also
+   * take the tail extent: its end was forced by the previous write and not by
+   * the content, so it is chunked again along with the new data.
+   */
+  auto a = std::upper_bound(extents.begin(), extents.end(), offset,
+                            [](const off_t v, const Extent & e) {
+                              return v < stop(e);
+                            });
+  if (a == extents.end() && a != extents.begin()) {
+    --a;
+  }
+  auto b = std::lower_bound(a, extents.end(), last,
+                            [](const Extent & e, const off_t v) {
+                              return e.offset < v;
+                            });
+  off_t rbeg = a == extents.end() ? fsize : a->offset;
+  off_t rend = b > a ? std::max(last, stop(*(b - 1))) : last;
+  /*
+   * Only the first and last extents can stick out of the write. The parts of
+   * holes that do are kept as holes, so that the region below is bounded by
+   * the size of the write and of the chunks around it.
+   */
+  Extents fresh;
+  Extent tail = { 0, 0, true, Digest() };
+  if (a != extents.end() && a->hole && a->offset < offset) {
+    Extent e = { a->offset, static_cast<size_t>(offset - a->offset), true,
+      Digest() };
+    fresh.push_back(e);
+    rbeg = offset;
+  }
+  if (b > a && (b - 1)->hole && stop(*(b - 1)) > last) {
+    tail.offset = last;
+    tail.length = static_cast<size_t>(stop(*(b - 1)) - last);
+    rend = last;
+  }
+  /*
+   * Build the new content of the region from the old data and the written
+   * data.
+   */
+  std::string region(static_cast<size_t>(rend - rbeg), '\0');
+  off_t known = std::min(rend, fsize);
+  if (known > rbeg) {
+    assemble(extents, &region[0], static_cast<size_t>(known - rbeg), rbeg);
+  }
+  memcpy(&region[0] + (offset - rbeg), buf, size);
+  /*
+   * Acquire the new chunks before releasing the old ones so that the chunks
+   * common to both are not dropped from the index.
+   */
+  chunk(region.data(), region.size(), rbeg, fresh);
+  if (tail.length) {
+    fresh.push_back(tail);
+  }
+  for (auto it = a; it != b; ++it) {
+    release(*it);
+  }
+  auto pos = extents.erase(a, b);
+  extents.insert(pos, fresh.begin(), fresh.end());
+}
+
+}
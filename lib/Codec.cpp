@@ -0,0 +1,79 @@
+#include <fuse-cpp/Codec.h>
+
+#ifdef HAVE_LZ4
+#include <lz4.h>
+#endif
+
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
+
+namespace FUSE {
+
+#ifdef HAVE_LZ4
+
+/*
+ * LZ4 codec.
+ */
+
+size_t
+LZ4Codec::bound(const size_t size) const
+{
+  return LZ4_compressBound(static_cast<int>(size));
+}
+
+int
+LZ4Codec::compress(const char * const src, const size_t size,
+                   char * const dst, const size_t capacity) const
+{
+  return LZ4_compress_default(src, dst, static_cast<int>(size),
+                              static_cast<int>(capacity));
+}
+
+int
+LZ4Codec::decompress(const char * const src, const size_t size,
+                     char * const dst, const size_t capacity) const
+{
+  return LZ4_decompress_safe(src, dst, static_cast<int>(size),
+                             static_cast<int>(capacity));
+}
+
+#endif
+
+#ifdef HAVE_ZSTD
+
+/*
+ * Zstandard codec.
+ */
+
+ZstdCodec::ZstdCodec(const int level)
+  : m_level(level)
+{
+
+}
+
+size_t
+ZstdCodec::bound(const size_t size) const
+{
+  return ZSTD_compressBound(size);
+}
+
+int
+ZstdCodec::compress(const char * const src, const size_t size,
+                    char * const dst, const size_t capacity) const
+{
+  size_t r = ZSTD_compress(dst, capacity, src, size, m_level);
+  return ZSTD_isError(r) ? -1 : static_cast<int>(r);
+}
+
+int
+ZstdCodec::decompress(const char * const src, const size_t size,
+                      char * const dst, const size_t capacity) const
+{
+  size_t r = ZSTD_decompress(dst, capacity, src, size);
+  return ZSTD_isError(r) ? -1 : static_cast<int>(r);
+}
+
+#endif
+
+}
@@ -0,0 +1,14 @@
+#include <fuse-cpp/CompressedContext.h>
+
+namespace FUSE {
+
+CompressedContext::CompressedContext(Context & inner, const Codec & codec,
+                                     const size_t blockSize,
+                                     const size_t cacheSize,
+                                     const size_t threads)
+  : Stack(codec, Compressor::Options(blockSize, cacheSize, threads), inner)
+{
+
+}
+
+}
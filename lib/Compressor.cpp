@@ -0,0 +1,420 @@
+#include <fuse-cpp/Compressor.h>
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <iterator>
+
+namespace FUSE {
+
+/*
+ * Little-endian helpers.
+ */
+
+namespace {
+
+inline void
+put32(char * const p, const uint32_t v)
+{
+  for (size_t i = 0; i < 4; i += 1) {
+    p[i] = static_cast<char>(v >> (8 * i));
+  }
+}
+
+inline void
+put64(char * const p, const uint64_t v)
+{
+  for (size_t i = 0; i < 8; i += 1) {
+    p[i] = static_cast<char>(v >> (8 * i));
+  }
+}
+
+inline uint32_t
+get32(const char * const p)
+{
+  uint32_t v = 0;
+  for (size_t i = 0; i < 4; i += 1) {
+    v |= static_cast<uint32_t>(static_cast<uint8_t>(p[i])) << (8 * i);
+  }
+  return v;
+}
+
+inline uint64_t
+get64(const char * const p)
+{
+  uint64_t v = 0;
+  for (size_t i = 0; i < 8; i += 1) {
+    v |= static_cast<uint64_t>(static_cast<uint8_t>(p[i])) << (8 * i);
+  }
+  return v;
+}
+
+}
+
+const off_t Compressor::HEADER;
+const size_t Compressor::LENGTH;
+const uint32_t Compressor::MAGIC;
+const uint32_t Compressor::RAW;
+
+/*
+ * Constructors and destructor.
+ */
+
+Compressor::Options::Options(const size_t blockSize, const size_t cacheSize,
+                             const size_t threads)
+  : blockSize(blockSize)
+  , cacheSize(cacheSize)
+  , threads(threads)
+{
+
+}
+
+Compressor::Compressor(const Codec & codec, const Options & options)
+  : m_codec(codec)
+  , m_blockSize(options.blockSize)
+  , m_slotSize(LENGTH + std::max(codec.bound(options.blockSize),
+                                 options.blockSize))
+  , m_cacheSize(options.cacheSize)
+  , m_threads(options.threads)
+  , m_lock()
+  , m_files()
+  , m_nextId(0)
+  , m_cache()
+  , m_lru()
+  , m_jobLock()
+  , m_poolLock()
+  , m_poolCond()
+  , m_doneCond()
+  , m_workers()
+  , m_job(nullptr)
+  , m_jobCount(0)
+  , m_jobNext(0)
+  , m_jobActive(0)
+  , m_generation(0)
+  , m_stop(false)
+{
+
+}
+
+Compressor::~Compressor()
+{
+  stop();
+}
+
+/*
+ * Block format.
+ */
+
+off_t
+Compressor::slotOffset(const uint64_t index) const
+{
+  return HEADER + static_cast<off_t>(index * m_slotSize);
+}
+
+void
+Compressor::header(char * const buf, const off_t size) const
+{
+  put32(buf, MAGIC);
+  put32(buf + 4, static_cast<uint32_t>(m_blockSize));
+  put64(buf + 8, static_cast<uint64_t>(size));
+}
+
+int
+Compressor::header(const char * const buf, const size_t len,
+                   off_t & size) const
+{
+  if (len == 0) {
+    size = 0;
+    return 0;
+  }
+  if (len != static_cast<size_t>(HEADER) || get32(buf) != MAGIC ||
+      get32(buf + 4) != m_blockSize) {
+    return -EIO;
+  }
+  size = static_cast<off_t>(get64(buf + 8));
+  return 0;
+}
+
+int
+Compressor::payload(const char * const len, size_t & size) const
+{
+  uint32_t stored = get32(len);
+  size = stored & ~RAW;
+  if (size > m_slotSize - LENGTH || ((stored & RAW) && size > m_blockSize)) {
+    return -EIO;
+  }
+  return 0;
+}
+
+int
+Compressor::decode(const char * const len, const std::string & payload,
+                   std::string & data) const
+{
+  data.assign(m_blockSize, '\0');
+  if (payload.empty()) {
+    return 0;
+  }
+  if (get32(len) & RAW) {
+    memcpy(&data[0], payload.data(), payload.size());
+    return 0;
+  }
+  int r = m_codec.decompress(payload.data(), payload.size(), &data[0],
+                             m_blockSize);
+  if (r < 0 || static_cast<size_t>(r) > m_blockSize) {
+    return -EIO;
+  }
+  /*
+   * Codecs may use the whole buffer as scratch space, but the bytes past the
+   * data must read as zeroes when the file grows within the block.
+   */
+  memset(&data[r], 0, m_blockSize - static_cast<size_t>(r));
+  return 0;
+}
+
+void
+Compressor::encode(Block & block) const
+{
+  size_t bound = m_slotSize - LENGTH;
+  block.slot.resize(m_slotSize);
+  int r = m_codec.compress(block.data.data(), block.length,
+                           &block.slot[LENGTH], bound);
+  /*
+   * Store incompressible blocks as is.
+   */
+  if (r <= 0 || static_cast<size_t>(r) >= block.length) {
+    block.slot.resize(LENGTH + block.length);
+    memcpy(&block.slot[LENGTH], block.data.data(), block.length);
+    put32(&block.slot[0], static_cast<uint32_t>(block.length) | RAW);
+  } else {
+    block.slot.resize(LENGTH + static_cast<size_t>(r));
+    put32(&block.slot[0], static_cast<uint32_t>(r));
+  }
+}
+
+/*
+ * File state.
+ */
+
+Compressor::FileRef
+Compressor::acquire(const ino_t ino)
+{
+  std::lock_guard<std::mutex> lock(m_lock);
+  FileRef & f = m_files[ino];
+  if (!f) {
+    f = std::make_shared<File>();
+    f->id = m_nextId++;
+    f->ino = ino;
+    f->handles = 0;
+    f->sized = false;
+    f->resized = false;
+    f->size = 0;
+  }
+  f->handles += 1;
+  return f;
+}
+
+Compressor::FileRef
+Compressor::find(const ino_t ino)
+{
+  std::lock_guard<std::mutex> lock(m_lock);
+  auto it = m_files.find(ino);
+  return it == m_files.end() ? FileRef() : it->second;
+}
+
+void
+Compressor::release(const FileRef & file)
+{
+  std::lock_guard<std::mutex> lock(m_lock);
+  file->handles -= 1;
+  if (file->handles != 0) {
+    return;
+  }
+  auto it = m_files.find(file->ino);
+  if (it != m_files.end() && it->second == file) {
+    m_files.erase(it);
+  }
+  evict(file->id, 0);
+}
+
+void
+Compressor::forget(const ino_t ino)
+{
+  std::lock_guard<std::mutex> lock(m_lock);
+  m_files.erase(ino);
+}
+
+/*
+ * Decompressed block cache, keyed by file identifier and block index.
+ */
+
+bool
+Compressor::lookup(const File & file, const uint64_t index, std::string & data)
+{
+  auto d = file.dirty.find(index);
+  if (d != file.dirty.end()) {
+    data = d->second;
+    return true;
+  }
+  std::lock_guard<std::mutex> lock(m_lock);
+  auto it = m_cache.find(Key(file.id, index));
+  if (it == m_cache.end()) {
+    return false;
+  }
+  m_lru.splice(m_lru.begin(), m_lru, it->second.lru);
+  data = it->second.data;
+  return true;
+}
+
+void
+Compressor::insert(const File & file, const uint64_t index,
+                   const std::string & data)
+{
+  Key key(file.id, index);
+  if (m_cacheSize == 0) {
+    return;
+  }
+  std::lock_guard<std::mutex> lock(m_lock);
+  auto it = m_cache.find(key);
+  if (it != m_cache.end()) {
+    m_lru.splice(m_lru.begin(), m_lru, it->second.lru);
+    it->second.data = data;
+    return;
+  }
+  m_lru.push_front(key);
+  Entry e = { data, m_lru.begin() };
+  m_cache.insert(std::make_pair(key, std::move(e)));
+  if (m_cache.size() > m_cacheSize) {
+    m_cache.erase(m_lru.back());
+    m_lru.pop_back();
+  }
+}
+
+void
+Compressor::modify(File & file, const uint64_t index, std::string & data)
+{
+  file.dirty[index].swap(data);
+  std::lock_guard<std::mutex> lock(m_lock);
+  auto it = m_cache.find(Key(file.id, index));
+  if (it != m_cache.end()) {
+    m_lru.erase(it->second.lru);
+    m_cache.erase(it);
+  }
+}
+
+void
+Compressor::drop(File & file, const uint64_t from)
+{
+  file.dirty.erase(file.dirty.lower_bound(from), file.dirty.end());
+  std::lock_guard<std::mutex> lock(m_lock);
+  evict(file.id, from);
+}
+
+void
+Compressor::evict(const uint64_t id, const uint64_t from)
+{
+  auto it = m_cache.lower_bound(Key(id, from));
+  while (it != m_cache.end() && it->first.first == id) {
+    m_lru.erase(it->second.lru);
+    it = m_cache.erase(it);
+  }
+}
+
+/*
+ * Encoding thread pool. Only one job runs at a time: a writer finding the
+ * pool busy encodes its blocks by itself. A job completes once every worker
+ * has checked in, so that no worker can pick an index of the next job with a
+ * stale function.
+ */
+
+void
+Compressor::start()
+{
+  std::lock_guard<std::mutex> lock(m_jobLock);
+  uint64_t generation;
+  {
+    std::lock_guard<std::mutex> pool(m_poolLock);
+    m_stop = false;
+    generation = m_generation;
+  }
+  /*
+   * The calling thread takes part in the encoding. The generation is handed
+   * over as no job can start before the job lock is released.
+   */
+  for (size_t i = m_workers.size() + 1; i < m_threads; i += 1) {
+    m_workers.push_back(std::thread(&Compressor::worker, this,
+                                    generation));
+  }
+}
+
+void
+Compressor::stop()
+{
+  std::lock_guard<std::mutex> lock(m_jobLock);
+  {
+    std::lock_guard<std::mutex> pool(m_poolLock);
+    m_stop = true;
+  }
+  m_poolCond.notify_all();
+  for (auto & t : m_workers) {
+    t.join();
+  }
+  m_workers.clear();
+}
+
+void
+Compressor::parallel(const size_t count,
+                            const std::function<void(size_t)> & job)
+{
+  std::unique_lock<std::mutex> busy(m_jobLock, std::try_to_lock);
+  if (!busy.owns_lock() || m_workers.empty() || count < 2) {
+    for (size_t i = 0; i < count; i += 1) {
+      job(i);
+    }
+    return;
+  }
+  {
+    std::lock_guard<std::mutex> lock(m_poolLock);
+    m_job = &job;
+    m_jobCount = count;
+    m_jobNext = 0;
+    m_jobActive = m_workers.size();
+    m_generation += 1;
+  }
+  m_poolCond.notify_all();
+  for (size_t i = m_jobNext++; i < count; i = m_jobNext++) {
+    job(i);
+  }
+  std::unique_lock<std::mutex> lock(m_poolLock);
+  m_doneCond.wait(lock, [this]() { return m_jobActive == 0; });
+  m_job = nullptr;
+}
+
+void
+Compressor::worker(uint64_t seen)
+{
+  for (;;) {
+    const std::function<void(size_t)> * job;
+    size_t count;
+    {
+      std::unique_lock<std::mutex> lock(m_poolLock);
+      m_poolCond.wait(lock, [this, seen]() {
+        return m_stop || m_generation != seen;
+      });
+      if (m_stop) {
+        return;
+      }
+      seen = m_generation;
+      job = m_job;
+      count = m_jobCount;
+    }
+    for (size_t i = m_jobNext++; i < count; i = m_jobNext++) {
+      (*job)(i);
+    }
+    std::lock_guard<std::mutex> lock(m_poolLock);
+    m_jobActive -= 1;
+    if (m_jobActive == 0) {
+      m_doneCond.notify_one();
+    }
+  }
+}
+
+}